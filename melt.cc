@@ -17,6 +17,7 @@
 #include <vector>
 #include <sstream>
 #include <map>
+#include <unordered_map>
 
 #include "melt/tests/generated/bunny_obj.h"
 #include "melt/tests/generated/column_obj.h"
@@ -44,10 +45,42 @@ static glm::mat4 position;
 
 static uint32_t model_vertex_count;
 static uint32_t occluder_vertex_count;
+// Duration of the melt_generate_occluder() call that produced the displayed occluder
+static double occluder_generation_ms;
 
 static bool depth_test_enabled = false;
 static bool paused = false;
 
+// Per-axis multiplier of melt_params.voxel_size
+static glm::vec3 voxel_axis_scale = glm::vec3(1.0f);
+
+// Principal axes of the loaded mesh, used as voxel grid axes when enabled
+static glm::mat3 principal_axes = glm::mat3(1.0f);
+static bool principal_axes_enabled = false;
+
+typedef struct
+{
+    uint32_t vertices_merged;
+    uint32_t triangles_dropped;
+} mesh_conditioning_stats;
+
+// Weld duplicate vertices and drop degenerate triangles before handing the mesh to melt
+static bool mesh_conditioning_enabled = false;
+static mesh_conditioning_stats conditioning_stats;
+
+// Why the last model load was refused, empty once a model loads
+static char model_load_error[128];
+
+struct position_hash
+{
+    size_t operator()(const glm::vec3& p) const
+    {
+        uint32_t bits[3];
+        memcpy(bits, &p[0], sizeof(bits));
+        return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+    }
+};
+
 typedef struct
 {
     glm::mat4 mvp;
@@ -153,6 +186,155 @@ static void init_melt_params()
     melt_params.box_type_flags = MELT_OCCLUDER_BOX_TYPE_REGULAR;
 }
 
+static glm::mat3 compute_principal_axes(const melt_vec3_t* vertices, uint32_t vertex_count)
+{
+    if (vertex_count == 0)
+        return glm::mat3(1.0f);
+
+    // Accumulate in double, float sums over every vertex leave off-diagonal noise above the skip threshold
+    glm::dvec3 mean(0.0);
+    for (uint32_t i = 0; i < vertex_count; i++)
+        mean += glm::dvec3(vertices[i].x, vertices[i].y, vertices[i].z);
+    mean /= double(vertex_count);
+
+    glm::dmat3 sum(0.0);
+    for (uint32_t i = 0; i < vertex_count; i++)
+    {
+        glm::dvec3 d = glm::dvec3(vertices[i].x, vertices[i].y, vertices[i].z) - mean;
+        sum += glm::outerProduct(d, d);
+    }
+    glm::mat3 covariance = glm::mat3(sum / double(vertex_count));
+
+    // Cyclic Jacobi sweeps, the eigenvectors accumulate in the columns of axes
+    glm::mat3 axes(1.0f);
+    for (int sweep = 0; sweep < 16; sweep++)
+    {
+        for (int p = 0; p < 2; p++)
+        {
+            for (int q = p + 1; q < 3; q++)
+            {
+                // Relative to the diagonal, an absolute threshold lets rounding noise pick the rotation
+                if (std::abs(covariance[q][p]) <= 1e-6f * (std::abs(covariance[p][p]) + std::abs(covariance[q][q])))
+                    continue;
+
+                float theta = (covariance[q][q] - covariance[p][p]) / (2.0f * covariance[q][p]);
+                float t = (theta >= 0.0f ? 1.0f : -1.0f) / (std::abs(theta) + std::sqrt(theta * theta + 1.0f));
+                float c = 1.0f / std::sqrt(t * t + 1.0f);
+                float s = t * c;
+
+                glm::mat3 rotation(1.0f);
+                rotation[p][p] = c;
+                rotation[q][q] = c;
+                rotation[q][p] = s;
+                rotation[p][q] = -s;
+
+                covariance = glm::transpose(rotation) * covariance * rotation;
+                axes = axes * rotation;
+            }
+        }
+    }
+
+    // Axes of (nearly) equal eigenvalues are not defined by PCA, find the pairs that are
+    bool close[3];
+    int close_count = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        float lp = covariance[(k + 1) % 3][(k + 1) % 3];
+        float lq = covariance[(k + 2) % 3][(k + 2) % 3];
+        close[k] = std::abs(lp - lq) <= 1e-2f * glm::max(std::abs(lp), std::abs(lq));
+        close_count += close[k];
+    }
+
+    // No defined axis at all, keep the model axes
+    if (close_count > 1)
+        return glm::mat3(1.0f);
+
+    if (close_count == 1)
+    {
+        // Keep the distinct axis k, build the other two from the model axis most orthogonal to it
+        int k = close[0] ? 0 : (close[1] ? 1 : 2);
+        glm::vec3 distinct = glm::normalize(axes[k]);
+
+        int model_axis = 0;
+        for (int i = 1; i < 3; i++)
+        {
+            if (std::abs(distinct[i]) < std::abs(distinct[model_axis]))
+                model_axis = i;
+        }
+
+        glm::vec3 u(0.0f);
+        u[model_axis] = 1.0f;
+        u = glm::normalize(u - glm::dot(u, distinct) * distinct);
+
+        axes[k] = distinct;
+        axes[(k + 1) % 3] = u;
+        axes[(k + 2) % 3] = glm::cross(distinct, u);
+    }
+
+    // Keep a rotation, not a reflection
+    if (glm::determinant(axes) < 0.0f)
+        axes[2] = -axes[2];
+
+    return axes;
+}
+
+static mesh_conditioning_stats condition_mesh(std::vector<melt_vec3_t>& vertices, std::vector<uint32_t>& indices)
+{
+    mesh_conditioning_stats stats;
+    memset(&stats, 0, sizeof(mesh_conditioning_stats));
+
+    std::unordered_map<glm::vec3, uint32_t, position_hash> welded;
+    std::vector<uint32_t> remap(vertices.size());
+
+    uint32_t vertex_count = 0;
+    for (uint32_t i = 0; i < vertices.size(); i++)
+    {
+        const melt_vec3_t& v = vertices[i];
+        // Adding zero folds -0.0f into 0.0f so both hash the same
+        glm::vec3 p = glm::vec3(v.x, v.y, v.z) + glm::vec3(0.0f);
+        auto it = welded.find(p);
+        if (it == welded.end())
+        {
+            it = welded.emplace(p, vertex_count).first;
+            vertices[vertex_count++] = v;
+        }
+        remap[i] = it->second;
+    }
+
+    uint32_t index_count = 0;
+    for (uint32_t i = 0; i + 2 < indices.size(); i += 3)
+    {
+        uint32_t a = remap[indices[i + 0]];
+        uint32_t b = remap[indices[i + 1]];
+        uint32_t c = remap[indices[i + 2]];
+
+        const melt_vec3_t& va = vertices[a];
+        const melt_vec3_t& vb = vertices[b];
+        const melt_vec3_t& vc = vertices[c];
+        glm::vec3 ab = glm::vec3(vb.x - va.x, vb.y - va.y, vb.z - va.z);
+        glm::vec3 ac = glm::vec3(vc.x - va.x, vc.y - va.y, vc.z - va.z);
+        glm::vec3 bc = ac - ab;
+        float longest_edge2 = glm::max(glm::dot(ab, ab), glm::max(glm::dot(ac, ac), glm::dot(bc, bc)));
+
+        // Drop collapsed triangles and slivers whose height is under a millionth of their longest edge
+        if (a == b || b == c || a == c || glm::length(glm::cross(ab, ac)) <= 1e-6f * longest_edge2)
+        {
+            ++stats.triangles_dropped;
+            continue;
+        }
+
+        indices[index_count++] = a;
+        indices[index_count++] = b;
+        indices[index_count++] = c;
+    }
+
+    stats.vertices_merged = uint32_t(vertices.size()) - vertex_count;
+    vertices.resize(vertex_count);
+    indices.resize(index_count);
+
+    return stats;
+}
+
 static bool load_model_mesh(const char* model_name)
 {
     const char* model = nullptr;
@@ -180,6 +362,7 @@ static bool load_model_mesh(const char* model_name)
 
     if (!error.empty() || !obj_parsing_res)
     {
+        snprintf(model_load_error, sizeof(model_load_error), "Failed to parse %s", model_name);
         return false;
     }
 
@@ -187,6 +370,39 @@ static bool load_model_mesh(const char* model_name)
     for (size_t i = 0; i < shapes.size(); i++)
         vertex_count += shapes[i].mesh.indices.size();
 
+    // Shapes index their own position arrays, append them one after the other
+    std::vector<melt_vec3_t> melt_vertices;
+    std::vector<uint32_t> melt_indices;
+    for (size_t i = 0; i < shapes.size(); i++)
+    {
+        uint32_t vertex_offset = melt_vertices.size();
+        for (size_t f = 0; f < shapes[i].mesh.indices.size(); f++)
+            melt_indices.push_back(vertex_offset + shapes[i].mesh.indices[f]);
+        for (size_t v = 0; v < shapes[i].mesh.positions.size() / 3; v++)
+        {
+            melt_vec3_t position;
+            position.x = shapes[i].mesh.positions[3 * v + 0];
+            position.y = shapes[i].mesh.positions[3 * v + 1];
+            position.z = shapes[i].mesh.positions[3 * v + 2];
+            melt_vertices.push_back(position);
+        }
+    }
+
+    // tinyobj emits a position per distinct v/vn/vt tuple, weld before checking the index range
+    mesh_conditioning_stats stats;
+    memset(&stats, 0, sizeof(mesh_conditioning_stats));
+    if (mesh_conditioning_enabled)
+        stats = condition_mesh(melt_vertices, melt_indices);
+
+    // melt mesh indices are 16 bits, refuse the model rather than silently wrapping indices
+    if (melt_vertices.size() > UINT16_MAX + 1)
+    {
+        snprintf(model_load_error, sizeof(model_load_error), "%s has %u vertices, melt supports up to %u",
+            model_name, uint32_t(melt_vertices.size()), uint32_t(UINT16_MAX + 1));
+        return false;
+    }
+    model_load_error[0] = '\0';
+
     int output_index = 0;
     std::vector<glm::vec3> mesh_buffer_data(vertex_count * 2);
     for (size_t i = 0; i < shapes.size(); i++)
@@ -216,48 +432,79 @@ static bool load_model_mesh(const char* model_name)
 
     MELT_FREE(melt_params.mesh.vertices);
     MELT_FREE(melt_params.mesh.indices);
-    melt_params.mesh.vertex_count = 0;
-    melt_params.mesh.index_count = 0;
+    melt_params.mesh.vertex_count = melt_vertices.size();
+    melt_params.mesh.index_count = melt_indices.size();
 
-    for (size_t i = 0; i < shapes.size(); i++)
-    {
-        for (size_t f = 0; f < shapes[i].mesh.indices.size(); f++)
-            ++melt_params.mesh.index_count;
-        for (size_t v = 0; v < shapes[i].mesh.positions.size() / 3; v++)
-            ++melt_params.mesh.vertex_count;
-    }
-    
     melt_params.mesh.vertices = MELT_MALLOC(melt_vec3_t, melt_params.mesh.vertex_count);
     melt_params.mesh.indices = MELT_MALLOC(uint16_t, melt_params.mesh.index_count);
-   
-    for (size_t i = 0; i < shapes.size(); i++)
-    {
-        for (size_t f = 0; f < shapes[i].mesh.indices.size(); f++)
-            melt_params.mesh.indices[f] = shapes[i].mesh.indices[f];
-        for (size_t v = 0; v < shapes[i].mesh.positions.size() / 3; v++)
-        {
-            melt_params.mesh.vertices[v].x = shapes[i].mesh.positions[3 * v + 0];
-            melt_params.mesh.vertices[v].y = shapes[i].mesh.positions[3 * v + 1];
-            melt_params.mesh.vertices[v].z = shapes[i].mesh.positions[3 * v + 2];
-        }
-    }
 
+    for (size_t v = 0; v < melt_vertices.size(); v++)
+        melt_params.mesh.vertices[v] = melt_vertices[v];
+    for (size_t f = 0; f < melt_indices.size(); f++)
+        melt_params.mesh.indices[f] = uint16_t(melt_indices[f]);
+
+    conditioning_stats = stats;
     model_vertex_count = vertex_count;
+    principal_axes = compute_principal_axes(melt_params.mesh.vertices, melt_params.mesh.vertex_count);
 
     return true;
 }
 
+static glm::mat4 voxel_frame()
+{
+    glm::mat4 scale = glm::scale(glm::mat4(1.0f), voxel_axis_scale);
+    if (principal_axes_enabled)
+        return glm::mat4(principal_axes) * scale;
+    return scale;
+}
+
+static void transform_debug_vertices(melt_vec3_t* vertices, uint32_t vertex_count, const glm::mat4& transform)
+{
+    // Debug mesh vertices interleave positions and colors, only transform positions
+    for (uint32_t i = 0; i < vertex_count; i += 2)
+    {
+        melt_vec3_t& v = vertices[i];
+        glm::vec3 p = glm::vec3(transform * glm::vec4(v.x, v.y, v.z, 1.0f));
+        v.x = p.x;
+        v.y = p.y;
+        v.z = p.z;
+    }
+}
+
 static void generate_occluder()
 {
-    if (!melt_generate_occluder(melt_params, &melt_result))
+    // Voxelize where voxels are cubes of voxel_size, then bring the occluder back to model space
+    glm::mat4 frame = voxel_frame();
+    glm::mat4 inverse_frame = glm::inverse(frame);
+
+    std::vector<melt_vec3_t> frame_vertices(melt_params.mesh.vertex_count);
+    for (uint32_t i = 0; i < melt_params.mesh.vertex_count; i++)
+    {
+        const melt_vec3_t& v = melt_params.mesh.vertices[i];
+        glm::vec3 p = glm::vec3(inverse_frame * glm::vec4(v.x, v.y, v.z, 1.0f));
+        frame_vertices[i].x = p.x;
+        frame_vertices[i].y = p.y;
+        frame_vertices[i].z = p.z;
+    }
+
+    melt_params_t frame_params = melt_params;
+    frame_params.mesh.vertices = frame_vertices.data();
+
+    uint64_t start_time = stm_now();
+
+    if (!melt_generate_occluder(frame_params, &melt_result))
         return;
 
+    double generation_ms = stm_ms(stm_since(start_time));
+
     if (melt_result.debug_mesh.vertex_count == 0)
     {
         melt_free_result(melt_result);
         return;
     }
 
+    transform_debug_vertices(melt_result.debug_mesh.vertices, melt_result.debug_mesh.vertex_count, frame);
+
     sg_buffer_desc vbuf_desc;
     memset(&vbuf_desc, 0, sizeof(vbuf_desc));
     vbuf_desc.size = melt_result.debug_mesh.vertex_count * sizeof(melt_vec3_t);
@@ -265,7 +512,7 @@ static void generate_occluder()
     vbuf_desc.usage = SG_USAGE_IMMUTABLE;
     vbuf_desc.label = "occluder_position_buffer";
     vbuf_desc.content = melt_result.debug_mesh.vertices;
-    if (position_buffer.id != SG_INVALID_ID)
+    if (occluder_position_buffer.id != SG_INVALID_ID)
     {
         sg_destroy_buffer(occluder_position_buffer);
     }
@@ -288,6 +535,7 @@ static void generate_occluder()
     bindings_1.index_buffer = occluder_index_buffer;
 
     occluder_vertex_count = melt_result.debug_mesh.index_count;
+    occluder_generation_ms = generation_ms;
 
     melt_free_result(melt_result);
 }
@@ -304,6 +552,7 @@ static void init(void)
     desc.d3d11_depth_stencil_view_cb = sapp_d3d11_get_depth_stencil_view;
     desc.gl_force_gles2 = sapp_gles2();
     sg_setup(&desc);
+    stm_setup();
 
     simgui_desc_t simgui_desc = {};
     simgui_desc.no_default_font = true;
@@ -427,10 +676,12 @@ static void init(void)
     init_melt_params();
 
     const char* model_name = obj_models[0];
-    load_model_mesh(obj_models[0]);
-    melt_params.fill_pct = model_configs[model_name].fill_percentage;
-    melt_params.voxel_size = model_configs[model_name].voxel_resolution;
-    generate_occluder();
+    if (load_model_mesh(obj_models[0]))
+    {
+        melt_params.fill_pct = model_configs[model_name].fill_percentage;
+        melt_params.voxel_size = model_configs[model_name].voxel_resolution;
+        generate_occluder();
+    }
 }
 
 static void simgui_frame()
@@ -445,18 +696,40 @@ static void simgui_frame()
     static bool box_type_sides = false;
     static bool box_type_regular = true;
 
+    // Keep the previous model selected when the new one can't be loaded
+    int previous_model_index = obj_model_index;
     if (ImGui::Combo("Obj model", &obj_model_index, obj_models, IM_ARRAYSIZE(obj_models)))
     {
         const char* model_name = obj_models[obj_model_index];
-        load_model_mesh(model_name);
-        melt_params.fill_pct = model_configs[model_name].fill_percentage;
-        melt_params.voxel_size = model_configs[model_name].voxel_resolution;
-        generate_occluder();
+        if (load_model_mesh(model_name))
+        {
+            melt_params.fill_pct = model_configs[model_name].fill_percentage;
+            melt_params.voxel_size = model_configs[model_name].voxel_resolution;
+            generate_occluder();
+        }
+        else
+        {
+            obj_model_index = previous_model_index;
+        }
     }
 
+    if (model_load_error[0] != '\0')
+        ImGui::Text("%s", model_load_error);
+
     ImGui::DragFloat("Voxel Size", &melt_params.voxel_size, 0.005f, 0.1f, 0.3f);
     ImGui::DragFloat("Fill Percentage", &melt_params.fill_pct, 0.01f, 0.0f, 1.0f);
 
+    ImGui::DragFloat3("Voxel Axis Scale", &voxel_axis_scale.x, 0.01f, 0.25f, 4.0f);
+    ImGui::Checkbox("Principal Axes", &principal_axes_enabled);
+
+    if (ImGui::Checkbox("Condition Mesh", &mesh_conditioning_enabled))
+    {
+        if (load_model_mesh(obj_models[obj_model_index]))
+            generate_occluder();
+        else
+            mesh_conditioning_enabled = !mesh_conditioning_enabled;
+    }
+
     ImGui::Checkbox("BoxTypeDiagonals", &box_type_diagonals);
     ImGui::Checkbox("BoxTypeTop", &box_type_top);
     ImGui::Checkbox("BoxTypeBottom", &box_type_bottom);
@@ -483,6 +756,13 @@ static void simgui_frame()
     ImGui::Text("Model vertex count %d", model_vertex_count);
     float pct_reduction = 100.0f - (100.0f * (float(occluder_vertex_count) / model_vertex_count));
     ImGui::Text("Reduction percentage %2.f%%", pct_reduction);
+    ImGui::Text("Generation time %.2f ms", occluder_generation_ms);
+
+    if (mesh_conditioning_enabled)
+    {
+        ImGui::Text("Welded vertices %d", conditioning_stats.vertices_merged);
+        ImGui::Text("Dropped triangles %d", conditioning_stats.triangles_dropped);
+    }
 
     ImGui::End();
 }